@@ -5,11 +5,24 @@
  */
 
 #include "ruby.h"
+#include "ruby/encoding.h"
+#include "ruby/io.h"
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+#include "ruby/io/buffer.h"
+#endif
 #include <string.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
 #include "portable_endian.h"
 
 #define BYTE_BUFFER_EMBEDDED_SIZE 512
+#define BYTE_BUFFER_INTERN_CACHE_SIZE 1024
+#define BYTE_BUFFER_INTERN_MAX_LEN 64
+
+#ifndef ST2FIX
+#define ST2FIX(h) LONG2FIX((long)(h))
+#endif
 
 static VALUE rb_byte_buffer_allocate(VALUE klass);
 static VALUE rb_byte_buffer_initialize(int argc, VALUE *argv, VALUE self);
@@ -24,25 +37,87 @@ static VALUE rb_byte_buffer_append_double(VALUE self, VALUE i);
 static VALUE rb_byte_buffer_append_float(VALUE self, VALUE i);
 static VALUE rb_byte_buffer_append_byte_array(VALUE self, VALUE ary);
 static VALUE rb_byte_buffer_discard(VALUE self, VALUE n);
+static VALUE rb_byte_buffer_has_p(VALUE self, VALUE n);
 static VALUE rb_byte_buffer_read(VALUE self, VALUE n);
+static VALUE rb_byte_buffer_try_read(VALUE self, VALUE n);
 static VALUE rb_byte_buffer_read_long(int argc, VALUE *argv, VALUE self);
+static VALUE rb_byte_buffer_try_read_long(int argc, VALUE *argv, VALUE self);
 static VALUE rb_byte_buffer_read_int(int argc, VALUE *argv, VALUE self);
+static VALUE rb_byte_buffer_try_read_int(int argc, VALUE *argv, VALUE self);
 static VALUE rb_byte_buffer_read_short(int argc, VALUE *argv, VALUE self);
+static VALUE rb_byte_buffer_try_read_short(int argc, VALUE *argv, VALUE self);
 static VALUE rb_byte_buffer_read_byte(int argc, VALUE *argv, VALUE self);
+static VALUE rb_byte_buffer_try_read_byte(int argc, VALUE *argv, VALUE self);
 static VALUE rb_byte_buffer_read_double(VALUE self);
+static VALUE rb_byte_buffer_try_read_double(VALUE self);
 static VALUE rb_byte_buffer_read_float(VALUE self);
+static VALUE rb_byte_buffer_try_read_float(VALUE self);
 static VALUE rb_byte_buffer_read_byte_array(int argc, VALUE *argv, VALUE self);
+static VALUE rb_byte_buffer_try_read_byte_array(int argc, VALUE *argv, VALUE self);
+static VALUE rb_byte_buffer_read_interned(VALUE self, VALUE n);
+static VALUE rb_byte_buffer_try_read_interned(VALUE self, VALUE n);
+static VALUE rb_byte_buffer_read_cql_string_interned(VALUE self);
+static VALUE rb_byte_buffer_try_read_cql_string_interned(VALUE self);
 static VALUE rb_byte_buffer_index(int argc, VALUE *argv, VALUE self);
 static VALUE rb_byte_buffer_update(VALUE self, VALUE location, VALUE bytes);
 static VALUE rb_byte_buffer_to_str(VALUE self);
 static VALUE rb_byte_buffer_inspect(VALUE self);
-
+static VALUE rb_byte_buffer_eql(VALUE self, VALUE other);
+static VALUE rb_byte_buffer_cmp(VALUE self, VALUE other);
+static VALUE rb_byte_buffer_hash(VALUE self);
+static VALUE rb_byte_buffer_start_with(int argc, VALUE *argv, VALUE self);
+static VALUE rb_byte_buffer_end_with(int argc, VALUE *argv, VALUE self);
+static VALUE rb_byte_buffer_murmur3_token(int argc, VALUE *argv, VALUE self);
+static VALUE rb_byte_buffer_xxhash64(int argc, VALUE *argv, VALUE self);
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+static VALUE rb_byte_buffer_to_io_buffer(VALUE self);
+static VALUE rb_byte_buffer_s_from_io_buffer(VALUE klass, VALUE io_buffer);
+#endif
+#ifdef HAVE_RB_IO_DESCRIPTOR
+static VALUE rb_byte_buffer_read_nonblock(int argc, VALUE *argv, VALUE self);
+static VALUE rb_byte_buffer_write_nonblock(int argc, VALUE *argv, VALUE self);
+#endif
+
+static VALUE rb_bit_io_allocate(VALUE klass);
+static VALUE rb_bit_io_initialize(VALUE self, VALUE buffer);
+static VALUE rb_bit_io_buffer(VALUE self);
+static VALUE rb_bit_reader_read_bits(VALUE self, VALUE n);
+static VALUE rb_bit_reader_read_bitmap(VALUE self, VALUE n);
+static VALUE rb_bit_reader_read_packed_bitmap(VALUE self, VALUE n);
+static VALUE rb_bit_reader_popcount(VALUE self, VALUE n);
+static VALUE rb_bit_reader_align(VALUE self);
+static VALUE rb_bit_writer_write_bits(VALUE self, VALUE v, VALUE n);
+static VALUE rb_bit_writer_write_bitmap(VALUE self, VALUE ary);
+static VALUE rb_bit_writer_flush(VALUE self);
+
+static void byte_buffer_mark(void *ptr);
 static void byte_buffer_free(void *ptr);
 static size_t byte_buffer_memsize(const void *ptr);
 
 static const rb_data_type_t buffer_data_type = {
     "byte_buffer/buffer",
-    {NULL, byte_buffer_free, byte_buffer_memsize}
+    {byte_buffer_mark, byte_buffer_free, byte_buffer_memsize}
+};
+
+/*
+ * State shared by BitReader and BitWriter. Reader keeps bit offset into first
+ * readable byte of the buffer, writer keeps bits not yet forming whole byte.
+ * Neither can notice the buffer being read or appended to directly, so the
+ * reader has to be aligned and the writer flushed before doing that.
+ */
+typedef struct {
+    VALUE   buffer;
+    size_t  bit_pos;
+    uint8_t pending;
+} bit_io_t;
+
+static void bit_io_mark(void *ptr);
+static void bit_io_free(void *ptr);
+static size_t bit_io_memsize(const void *ptr);
+
+static const rb_data_type_t bit_io_data_type = {
+    "byte_buffer/bit_io",
+    {bit_io_mark, bit_io_free, bit_io_memsize}
 };
 
 typedef struct {
@@ -51,6 +126,8 @@ typedef struct {
     size_t read_pos;
     char   embedded_buffer[BYTE_BUFFER_EMBEDDED_SIZE];
     char   *b_ptr;
+    VALUE  io_buffer;
+    VALUE  io_buffers;
 } buffer_t;
 
 #define READ_PTR(buffer_ptr) \
@@ -69,17 +146,77 @@ typedef struct {
     { if (buffer_ptr->read_pos + len > buffer_ptr->write_pos) \
         rb_raise(rb_eRangeError, "%zu bytes requred, but only %zu available", (size_t)len, READ_SIZE(buffer_ptr)); }
 
+#define CHECK_READ_CAPACITY(buffer_ptr,len,raise) \
+    { if (!(raise) && buffer_ptr->read_pos + len > buffer_ptr->write_pos) return Qnil; \
+      ENSURE_READ_CAPACITY(buffer_ptr, len); }
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static VALUE buffer_read(VALUE self, VALUE n, int raise);
+static VALUE buffer_read_long(int argc, VALUE *argv, VALUE self, int raise);
+static VALUE buffer_read_int(int argc, VALUE *argv, VALUE self, int raise);
+static VALUE buffer_read_short(int argc, VALUE *argv, VALUE self, int raise);
+static VALUE buffer_read_byte(int argc, VALUE *argv, VALUE self, int raise);
+static VALUE buffer_read_double(VALUE self, int raise);
+static VALUE buffer_read_float(VALUE self, int raise);
+static VALUE buffer_read_byte_array(int argc, VALUE *argv, VALUE self, int raise);
+static VALUE buffer_read_interned(VALUE self, VALUE n, int raise);
+static VALUE buffer_read_cql_string_interned(VALUE self, int raise);
 static int32_t value_to_int32(VALUE x);
 static int64_t value_to_int64(VALUE x);
 static double value_to_dbl(VALUE x);
 static void grow_buffer(buffer_t* buffer_ptr, size_t len);
+static VALUE interned_str(const char *ptr, long len, rb_encoding *enc);
+static size_t value_to_bit_count(VALUE n, size_t max);
+static uint64_t peek_bits(const char *ptr, size_t avail, size_t bit_pos, size_t n);
+static int popcount64(uint64_t x);
+static void invalidate_io_buffers(buffer_t *buffer_ptr);
+static int bytes_of(VALUE *other, const char **ptr, size_t *len);
+static void region_from_args(buffer_t *b, VALUE voffset, VALUE vlen, const char **ptr, size_t *len);
+static uint64_t load64le(const char *p);
+static uint64_t murmur3_fmix64(uint64_t k);
+static int64_t cassandra_murmur3_h1(const char *ptr, size_t len);
+static uint64_t xxh64_round(uint64_t acc, uint64_t input);
+static uint64_t xxh64_merge_round(uint64_t acc, uint64_t val);
+static uint64_t xxhash64(const char *ptr, size_t len, uint64_t seed);
+#ifdef HAVE_RB_IO_DESCRIPTOR
+static int exception_disabled_p(VALUE opts);
+static VALUE delegate_read_nonblock(VALUE self, VALUE io, VALUE n, VALUE opts);
+static VALUE delegate_write_nonblock(VALUE self, VALUE io, VALUE opts);
+#endif
+static void bit_reader_ensure(bit_io_t *r, buffer_t *b, size_t n);
+static void bit_writer_write(bit_io_t *w, buffer_t *b, uint64_t v, size_t n);
 
 static VALUE rb_cBuffer = 0;
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+static VALUE rb_cWeakMap = Qnil;
+static VALUE rb_eIOBufferLockedError = Qnil;
+static ID id_values;
+static ID id_locked_p;
+static ID id_aset;
+static ID id_byte_buffer;
+#endif
+#ifdef HAVE_RB_IO_DESCRIPTOR
+static ID id_exception;
+static ID id_read_nonblock;
+static ID id_write_nonblock;
+#endif
+#ifndef HAVE_RB_ENC_INTERNED_STR
+static VALUE intern_cache = Qnil;
+#endif
 
 void
 Init_byte_buffer_ext()
 {
     VALUE rb_mByteBuffer;
+    VALUE rb_cBitReader;
+    VALUE rb_cBitWriter;
 
     rb_mByteBuffer  = rb_define_module("ByteBuffer");
     rb_cBuffer      = rb_define_class_under(rb_mByteBuffer, "Buffer", rb_cObject);
@@ -98,18 +235,92 @@ Init_byte_buffer_ext()
     rb_define_method(rb_cBuffer, "append_float", rb_byte_buffer_append_float, 1);
     rb_define_method(rb_cBuffer, "append_byte_array", rb_byte_buffer_append_byte_array, 1);
     rb_define_method(rb_cBuffer, "discard", rb_byte_buffer_discard, 1);
+    rb_define_method(rb_cBuffer, "has?", rb_byte_buffer_has_p, 1);
     rb_define_method(rb_cBuffer, "read", rb_byte_buffer_read, 1);
+    rb_define_method(rb_cBuffer, "try_read", rb_byte_buffer_try_read, 1);
     rb_define_method(rb_cBuffer, "read_long", rb_byte_buffer_read_long, -1);
+    rb_define_method(rb_cBuffer, "try_read_long", rb_byte_buffer_try_read_long, -1);
     rb_define_method(rb_cBuffer, "read_int", rb_byte_buffer_read_int, -1);
+    rb_define_method(rb_cBuffer, "try_read_int", rb_byte_buffer_try_read_int, -1);
     rb_define_method(rb_cBuffer, "read_short", rb_byte_buffer_read_short, -1);
+    rb_define_method(rb_cBuffer, "try_read_short", rb_byte_buffer_try_read_short, -1);
     rb_define_method(rb_cBuffer, "read_byte", rb_byte_buffer_read_byte, -1);
+    rb_define_method(rb_cBuffer, "try_read_byte", rb_byte_buffer_try_read_byte, -1);
     rb_define_method(rb_cBuffer, "read_double", rb_byte_buffer_read_double, 0);
+    rb_define_method(rb_cBuffer, "try_read_double", rb_byte_buffer_try_read_double, 0);
     rb_define_method(rb_cBuffer, "read_float", rb_byte_buffer_read_float, 0);
+    rb_define_method(rb_cBuffer, "try_read_float", rb_byte_buffer_try_read_float, 0);
     rb_define_method(rb_cBuffer, "read_byte_array", rb_byte_buffer_read_byte_array, -1);
+    rb_define_method(rb_cBuffer, "try_read_byte_array", rb_byte_buffer_try_read_byte_array, -1);
+    rb_define_method(rb_cBuffer, "read_interned", rb_byte_buffer_read_interned, 1);
+    rb_define_method(rb_cBuffer, "try_read_interned", rb_byte_buffer_try_read_interned, 1);
+    rb_define_method(rb_cBuffer, "read_cql_string_interned", rb_byte_buffer_read_cql_string_interned, 0);
+    rb_define_method(rb_cBuffer, "try_read_cql_string_interned", rb_byte_buffer_try_read_cql_string_interned, 0);
     rb_define_method(rb_cBuffer, "index", rb_byte_buffer_index, -1);
     rb_define_method(rb_cBuffer, "update", rb_byte_buffer_update, 2);
     rb_define_method(rb_cBuffer, "to_str", rb_byte_buffer_to_str, 0);
     rb_define_method(rb_cBuffer, "inspect", rb_byte_buffer_inspect, 0);
+    rb_define_method(rb_cBuffer, "eql?", rb_byte_buffer_eql, 1);
+    rb_define_method(rb_cBuffer, "==", rb_byte_buffer_eql, 1);
+    rb_define_method(rb_cBuffer, "<=>", rb_byte_buffer_cmp, 1);
+    rb_define_method(rb_cBuffer, "hash", rb_byte_buffer_hash, 0);
+    rb_define_method(rb_cBuffer, "start_with?", rb_byte_buffer_start_with, -1);
+    rb_define_method(rb_cBuffer, "end_with?", rb_byte_buffer_end_with, -1);
+    rb_define_method(rb_cBuffer, "murmur3_token", rb_byte_buffer_murmur3_token, -1);
+    rb_define_method(rb_cBuffer, "xxhash64", rb_byte_buffer_xxhash64, -1);
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+    rb_define_method(rb_cBuffer, "to_io_buffer", rb_byte_buffer_to_io_buffer, 0);
+    rb_define_singleton_method(rb_cBuffer, "from_io_buffer", rb_byte_buffer_s_from_io_buffer, 1);
+    rb_cWeakMap = rb_path2class("ObjectSpace::WeakMap");
+    rb_global_variable(&rb_cWeakMap);
+    rb_eIOBufferLockedError = rb_path2class("IO::Buffer::LockedError");
+    rb_global_variable(&rb_eIOBufferLockedError);
+    id_values = rb_intern("values");
+    id_locked_p = rb_intern("locked?");
+    id_aset = rb_intern("[]=");
+    id_byte_buffer = rb_intern("__byte_buffer__");
+#endif
+#ifdef HAVE_RB_IO_DESCRIPTOR
+    rb_define_method(rb_cBuffer, "read_nonblock", rb_byte_buffer_read_nonblock, -1);
+    rb_define_method(rb_cBuffer, "write_nonblock", rb_byte_buffer_write_nonblock, -1);
+    id_exception = rb_intern("exception");
+    id_read_nonblock = rb_intern("read_nonblock");
+    id_write_nonblock = rb_intern("write_nonblock");
+#endif
+
+    /*
+     * BitReader consumes a byte from the buffer only once all its bits were
+     * read. Reading the buffer directly while in the middle of a byte makes
+     * the reader apply its bit offset to a different byte, call #align first.
+     */
+    rb_cBitReader   = rb_define_class_under(rb_mByteBuffer, "BitReader", rb_cObject);
+    rb_define_alloc_func(rb_cBitReader, rb_bit_io_allocate);
+    rb_define_method(rb_cBitReader, "initialize", rb_bit_io_initialize, 1);
+    rb_define_method(rb_cBitReader, "buffer", rb_bit_io_buffer, 0);
+    rb_define_method(rb_cBitReader, "read_bits", rb_bit_reader_read_bits, 1);
+    rb_define_method(rb_cBitReader, "read_bitmap", rb_bit_reader_read_bitmap, 1);
+    rb_define_method(rb_cBitReader, "read_packed_bitmap", rb_bit_reader_read_packed_bitmap, 1);
+    rb_define_method(rb_cBitReader, "popcount", rb_bit_reader_popcount, 1);
+    rb_define_method(rb_cBitReader, "align", rb_bit_reader_align, 0);
+
+    /*
+     * BitWriter holds bits of an incomplete byte until it is filled or
+     * #flush is called. Appending to the buffer directly before #flush puts
+     * those bits after the appended data.
+     */
+    rb_cBitWriter   = rb_define_class_under(rb_mByteBuffer, "BitWriter", rb_cObject);
+    rb_define_alloc_func(rb_cBitWriter, rb_bit_io_allocate);
+    rb_define_method(rb_cBitWriter, "initialize", rb_bit_io_initialize, 1);
+    rb_define_method(rb_cBitWriter, "buffer", rb_bit_io_buffer, 0);
+    rb_define_method(rb_cBitWriter, "write_bits", rb_bit_writer_write_bits, 2);
+    rb_define_method(rb_cBitWriter, "write_bitmap", rb_bit_writer_write_bitmap, 1);
+    rb_define_method(rb_cBitWriter, "flush", rb_bit_writer_flush, 0);
+
+#ifndef HAVE_RB_ENC_INTERNED_STR
+    intern_cache = rb_ary_new2(BYTE_BUFFER_INTERN_CACHE_SIZE);
+    rb_ary_store(intern_cache, BYTE_BUFFER_INTERN_CACHE_SIZE - 1, Qnil);
+    rb_global_variable(&intern_cache);
+#endif
 }
 
 VALUE
@@ -119,6 +330,8 @@ rb_byte_buffer_allocate(VALUE klass)
     VALUE obj = TypedData_Make_Struct(klass, buffer_t, &buffer_data_type, b);
     b->b_ptr = b->embedded_buffer;
     b->size  = BYTE_BUFFER_EMBEDDED_SIZE;
+    b->io_buffer = Qnil;
+    b->io_buffers = Qnil;
 
     return obj;
 }
@@ -140,6 +353,7 @@ rb_byte_buffer_initialize(int argc, VALUE *argv, VALUE self)
         TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
 
         if ((size_t)len > b->size) {
+            invalidate_io_buffers(b);
             if (b->b_ptr != b->embedded_buffer) xfree(b->b_ptr);
             b->b_ptr = ALLOC_N(char, len);
             b->size = len;
@@ -351,7 +565,21 @@ rb_byte_buffer_discard(VALUE self, VALUE n)
 }
 
 VALUE
-rb_byte_buffer_read(VALUE self, VALUE n)
+rb_byte_buffer_has_p(VALUE self, VALUE n)
+{
+    buffer_t *b;
+    long len;
+
+    Check_Type(n, T_FIXNUM);
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+    len = FIX2LONG(n);
+    if (len < 0) rb_raise(rb_eRangeError, "Cannot check a negative number of bytes");
+
+    return READ_SIZE(b) >= (size_t)len ? Qtrue : Qfalse;
+}
+
+VALUE
+buffer_read(VALUE self, VALUE n, int raise)
 {
     buffer_t *b;
     long len;
@@ -361,7 +589,7 @@ rb_byte_buffer_read(VALUE self, VALUE n)
     TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
     len = FIX2LONG(n);
     if (len < 0) rb_raise(rb_eRangeError, "Cannot read a negative number of bytes");
-    ENSURE_READ_CAPACITY(b, len);
+    CHECK_READ_CAPACITY(b, len, raise);
     str = rb_str_new(READ_PTR(b), len);
     b->read_pos += len;
 
@@ -369,7 +597,19 @@ rb_byte_buffer_read(VALUE self, VALUE n)
 }
 
 VALUE
-rb_byte_buffer_read_long(int argc, VALUE *argv, VALUE self)
+rb_byte_buffer_read(VALUE self, VALUE n)
+{
+    return buffer_read(self, n, 1);
+}
+
+VALUE
+rb_byte_buffer_try_read(VALUE self, VALUE n)
+{
+    return buffer_read(self, n, 0);
+}
+
+VALUE
+buffer_read_long(int argc, VALUE *argv, VALUE self, int raise)
 {
     VALUE f_signed;
     buffer_t *b;
@@ -378,7 +618,7 @@ rb_byte_buffer_read_long(int argc, VALUE *argv, VALUE self)
     rb_scan_args(argc, argv, "01", &f_signed);
 
     TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
-    ENSURE_READ_CAPACITY(b, 8);
+    CHECK_READ_CAPACITY(b, 8, raise);
     i64 = be64toh(*((uint64_t*)READ_PTR(b)));
     b->read_pos += 8;
 
@@ -389,7 +629,19 @@ rb_byte_buffer_read_long(int argc, VALUE *argv, VALUE self)
 }
 
 VALUE
-rb_byte_buffer_read_int(int argc, VALUE *argv, VALUE self)
+rb_byte_buffer_read_long(int argc, VALUE *argv, VALUE self)
+{
+    return buffer_read_long(argc, argv, self, 1);
+}
+
+VALUE
+rb_byte_buffer_try_read_long(int argc, VALUE *argv, VALUE self)
+{
+    return buffer_read_long(argc, argv, self, 0);
+}
+
+VALUE
+buffer_read_int(int argc, VALUE *argv, VALUE self, int raise)
 {
     VALUE f_signed;
     buffer_t *b;
@@ -398,7 +650,7 @@ rb_byte_buffer_read_int(int argc, VALUE *argv, VALUE self)
     rb_scan_args(argc, argv, "01", &f_signed);
 
     TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
-    ENSURE_READ_CAPACITY(b, 4);
+    CHECK_READ_CAPACITY(b, 4, raise);
     i32 = be32toh(*((uint32_t*)READ_PTR(b)));
     b->read_pos += 4;
 
@@ -409,7 +661,19 @@ rb_byte_buffer_read_int(int argc, VALUE *argv, VALUE self)
 }
 
 VALUE
-rb_byte_buffer_read_short(int argc, VALUE *argv, VALUE self)
+rb_byte_buffer_read_int(int argc, VALUE *argv, VALUE self)
+{
+    return buffer_read_int(argc, argv, self, 1);
+}
+
+VALUE
+rb_byte_buffer_try_read_int(int argc, VALUE *argv, VALUE self)
+{
+    return buffer_read_int(argc, argv, self, 0);
+}
+
+VALUE
+buffer_read_short(int argc, VALUE *argv, VALUE self, int raise)
 {
     VALUE f_signed;
     buffer_t *b;
@@ -418,7 +682,7 @@ rb_byte_buffer_read_short(int argc, VALUE *argv, VALUE self)
     rb_scan_args(argc, argv, "01", &f_signed);
 
     TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
-    ENSURE_READ_CAPACITY(b, 2);
+    CHECK_READ_CAPACITY(b, 2, raise);
     i16 = be16toh(*((uint16_t*)READ_PTR(b)));
     b->read_pos += 2;
 
@@ -429,7 +693,19 @@ rb_byte_buffer_read_short(int argc, VALUE *argv, VALUE self)
 }
 
 VALUE
-rb_byte_buffer_read_byte(int argc, VALUE *argv, VALUE self)
+rb_byte_buffer_read_short(int argc, VALUE *argv, VALUE self)
+{
+    return buffer_read_short(argc, argv, self, 1);
+}
+
+VALUE
+rb_byte_buffer_try_read_short(int argc, VALUE *argv, VALUE self)
+{
+    return buffer_read_short(argc, argv, self, 0);
+}
+
+VALUE
+buffer_read_byte(int argc, VALUE *argv, VALUE self, int raise)
 {
     VALUE f_signed;
     buffer_t *b;
@@ -438,7 +714,7 @@ rb_byte_buffer_read_byte(int argc, VALUE *argv, VALUE self)
     rb_scan_args(argc, argv, "01", &f_signed);
 
     TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
-    ENSURE_READ_CAPACITY(b, 1);
+    CHECK_READ_CAPACITY(b, 1, raise);
     i8 = *((uint8_t*)READ_PTR(b));
     b->read_pos += 1;
 
@@ -449,13 +725,25 @@ rb_byte_buffer_read_byte(int argc, VALUE *argv, VALUE self)
 }
 
 VALUE
-rb_byte_buffer_read_double(VALUE self)
+rb_byte_buffer_read_byte(int argc, VALUE *argv, VALUE self)
+{
+    return buffer_read_byte(argc, argv, self, 1);
+}
+
+VALUE
+rb_byte_buffer_try_read_byte(int argc, VALUE *argv, VALUE self)
+{
+    return buffer_read_byte(argc, argv, self, 0);
+}
+
+VALUE
+buffer_read_double(VALUE self, int raise)
 {
     buffer_t *b;
     union {uint64_t i64; double d;} ucast;
 
     TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
-    ENSURE_READ_CAPACITY(b, 8);
+    CHECK_READ_CAPACITY(b, 8, raise);
     ucast.i64 = be64toh(*(uint64_t*)READ_PTR(b));
     b->read_pos += 8;
 
@@ -463,13 +751,25 @@ rb_byte_buffer_read_double(VALUE self)
 }
 
 VALUE
-rb_byte_buffer_read_float(VALUE self)
+rb_byte_buffer_read_double(VALUE self)
+{
+    return buffer_read_double(self, 1);
+}
+
+VALUE
+rb_byte_buffer_try_read_double(VALUE self)
+{
+    return buffer_read_double(self, 0);
+}
+
+VALUE
+buffer_read_float(VALUE self, int raise)
 {
     buffer_t *b;
     union {float d; uint32_t i32;} ucast;
 
     TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
-    ENSURE_READ_CAPACITY(b, 4);
+    CHECK_READ_CAPACITY(b, 4, raise);
     ucast.i32 = be32toh(*(uint32_t*)READ_PTR(b));
     b->read_pos += 4;
 
@@ -477,7 +777,19 @@ rb_byte_buffer_read_float(VALUE self)
 }
 
 VALUE
-rb_byte_buffer_read_byte_array(int argc, VALUE *argv, VALUE self)
+rb_byte_buffer_read_float(VALUE self)
+{
+    return buffer_read_float(self, 1);
+}
+
+VALUE
+rb_byte_buffer_try_read_float(VALUE self)
+{
+    return buffer_read_float(self, 0);
+}
+
+VALUE
+buffer_read_byte_array(int argc, VALUE *argv, VALUE self, int raise)
 {
     buffer_t *b;
     VALUE n;
@@ -494,7 +806,7 @@ rb_byte_buffer_read_byte_array(int argc, VALUE *argv, VALUE self)
     b_signed = RTEST(f_signed);
 
     TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
-    ENSURE_READ_CAPACITY(b, len);
+    CHECK_READ_CAPACITY(b, len, raise);
 
     ary = rb_ary_new();
     for (i=0; i<len; ++i) {
@@ -510,6 +822,77 @@ rb_byte_buffer_read_byte_array(int argc, VALUE *argv, VALUE self)
     return ary;
 }
 
+VALUE
+rb_byte_buffer_read_byte_array(int argc, VALUE *argv, VALUE self)
+{
+    return buffer_read_byte_array(argc, argv, self, 1);
+}
+
+VALUE
+rb_byte_buffer_try_read_byte_array(int argc, VALUE *argv, VALUE self)
+{
+    return buffer_read_byte_array(argc, argv, self, 0);
+}
+
+VALUE
+buffer_read_interned(VALUE self, VALUE n, int raise)
+{
+    buffer_t *b;
+    long len;
+    VALUE str;
+
+    Check_Type(n, T_FIXNUM);
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+    len = FIX2LONG(n);
+    if (len < 0) rb_raise(rb_eRangeError, "Cannot read a negative number of bytes");
+    CHECK_READ_CAPACITY(b, len, raise);
+    str = interned_str(READ_PTR(b), len, rb_ascii8bit_encoding());
+    b->read_pos += len;
+
+    return str;
+}
+
+VALUE
+rb_byte_buffer_read_interned(VALUE self, VALUE n)
+{
+    return buffer_read_interned(self, n, 1);
+}
+
+VALUE
+rb_byte_buffer_try_read_interned(VALUE self, VALUE n)
+{
+    return buffer_read_interned(self, n, 0);
+}
+
+VALUE
+buffer_read_cql_string_interned(VALUE self, int raise)
+{
+    buffer_t *b;
+    uint16_t len;
+    VALUE str;
+
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+    CHECK_READ_CAPACITY(b, 2, raise);
+    len = be16toh(*((uint16_t*)READ_PTR(b)));
+    CHECK_READ_CAPACITY(b, 2 + (size_t)len, raise);
+    str = interned_str(READ_PTR(b) + 2, len, rb_utf8_encoding());
+    b->read_pos += 2 + len;
+
+    return str;
+}
+
+VALUE
+rb_byte_buffer_read_cql_string_interned(VALUE self)
+{
+    return buffer_read_cql_string_interned(self, 1);
+}
+
+VALUE
+rb_byte_buffer_try_read_cql_string_interned(VALUE self)
+{
+    return buffer_read_cql_string_interned(self, 0);
+}
+
 VALUE
 rb_byte_buffer_index(int argc, VALUE *argv, VALUE self)
 {
@@ -585,94 +968,1033 @@ rb_byte_buffer_inspect(VALUE self)
     return str;
 }
 
-int32_t
-value_to_int32(VALUE x)
+VALUE
+rb_byte_buffer_eql(VALUE self, VALUE other)
 {
-    if (FIXNUM_P(x)) {
-        int64_t i64 = FIX2LONG(x);
+    buffer_t *b;
+    const char *other_ptr;
+    size_t other_len;
 
-        if (i64 > 0xFFFFFFFF || -i64 > 0x80000000)
-            rb_raise(rb_eRangeError, "Number %" PRId64 " is too big", i64);
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+    if (!bytes_of(&other, &other_ptr, &other_len))
+        return Qfalse;
+    if (other_len != READ_SIZE(b))
+        return Qfalse;
+    /* contents are binary, so like String#eql? reject other non-ASCII text */
+    if (RB_TYPE_P(other, T_STRING) && ENCODING_GET(other) != rb_ascii8bit_encindex() &&
+        !rb_enc_str_asciionly_p(other))
+        return Qfalse;
+
+    return memcmp(READ_PTR(b), other_ptr, other_len) == 0 ? Qtrue : Qfalse;
+}
 
-        return (int32_t)i64;
-    } else if (TYPE(x) == T_BIGNUM)
-        rb_raise(rb_eRangeError, "expected `interger', got `bignum'");
-    else
-        rb_raise(rb_eTypeError, "expected `interger', got %s ", rb_obj_classname(x));
+VALUE
+rb_byte_buffer_cmp(VALUE self, VALUE other)
+{
+    buffer_t *b;
+    const char *other_ptr;
+    size_t other_len;
+    int r;
 
-    return 0;
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+    if (!bytes_of(&other, &other_ptr, &other_len))
+        return Qnil;
+
+    r = memcmp(READ_PTR(b), other_ptr, READ_SIZE(b) < other_len ? READ_SIZE(b) : other_len);
+    if (r == 0)
+        r = READ_SIZE(b) == other_len ? 0 : (READ_SIZE(b) < other_len ? -1 : 1);
+
+    return INT2FIX(r < 0 ? -1 : (r > 0 ? 1 : 0));
 }
 
-int64_t
-value_to_int64(VALUE x)
+/*
+ * Same value as to_str.hash, computed in place with interpreter's seeded
+ * hash function.
+ */
+VALUE
+rb_byte_buffer_hash(VALUE self)
 {
-    if (FIXNUM_P(x))
-        return FIX2LONG(x);
-    else if (TYPE(x) == T_BIGNUM && RBIGNUM_SIGN(x))
-        return (int64_t)rb_big2ull(x);
-    else if (TYPE(x) == T_BIGNUM && !RBIGNUM_SIGN(x))
-        return rb_big2ll(x);
-    else
-        rb_raise(rb_eTypeError, "expected `interger' or `bignum', got %s ", rb_obj_classname(x));
+    buffer_t *b;
 
-    return 0;
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+
+    return ST2FIX(rb_memhash(READ_PTR(b), READ_SIZE(b)));
 }
 
-double
-value_to_dbl(VALUE x)
+VALUE
+rb_byte_buffer_start_with(int argc, VALUE *argv, VALUE self)
 {
-    if (FIXNUM_P(x))
-        return ((double)FIX2LONG(x));
-    else if (TYPE(x) == T_FLOAT)
-        return RFLOAT_VALUE(x);
-    else if (TYPE(x) == T_BIGNUM)
-        return rb_big2dbl(x);
-    else
-        rb_raise(rb_eTypeError, "expected a numeric type, got %s ", rb_obj_classname(x));
+    buffer_t *b;
+    int i;
 
-    return 0.0;
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+    for (i = 0; i < argc; ++i) {
+        VALUE prefix = argv[i];
+        const char *prefix_ptr;
+        size_t prefix_len;
+
+        if (!bytes_of(&prefix, &prefix_ptr, &prefix_len))
+            rb_raise(rb_eTypeError, "no implicit conversion of %s into String", rb_obj_classname(argv[i]));
+        if (prefix_len <= READ_SIZE(b) && memcmp(READ_PTR(b), prefix_ptr, prefix_len) == 0)
+            return Qtrue;
+    }
+
+    return Qfalse;
 }
 
-void
-grow_buffer(buffer_t* buffer_ptr, size_t len)
+VALUE
+rb_byte_buffer_end_with(int argc, VALUE *argv, VALUE self)
 {
-    size_t new_size = buffer_ptr->write_pos - buffer_ptr->read_pos + len;
-
-    if (new_size <= buffer_ptr->size) {
-        memmove(buffer_ptr->b_ptr, READ_PTR(buffer_ptr), READ_SIZE(buffer_ptr));
-        buffer_ptr->write_pos -= buffer_ptr->read_pos;
-        buffer_ptr->read_pos = 0;
-    } else {
-        char *new_b_ptr;
+    buffer_t *b;
+    int i;
 
-        new_size += new_size / 2;
-        new_b_ptr = ALLOC_N(char, new_size);
-        memcpy(new_b_ptr, READ_PTR(buffer_ptr), READ_SIZE(buffer_ptr));
-        if (buffer_ptr->b_ptr != buffer_ptr->embedded_buffer) xfree(buffer_ptr->b_ptr);
-        buffer_ptr->b_ptr = new_b_ptr;
-        buffer_ptr->size = new_size;
-        buffer_ptr->write_pos -= buffer_ptr->read_pos;
-        buffer_ptr->read_pos = 0;
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+    for (i = 0; i < argc; ++i) {
+        VALUE suffix = argv[i];
+        const char *suffix_ptr;
+        size_t suffix_len;
+
+        if (!bytes_of(&suffix, &suffix_ptr, &suffix_len))
+            rb_raise(rb_eTypeError, "no implicit conversion of %s into String", rb_obj_classname(argv[i]));
+        if (suffix_len <= READ_SIZE(b) &&
+            memcmp(WRITE_PTR(b) - suffix_len, suffix_ptr, suffix_len) == 0)
+            return Qtrue;
     }
+
+    return Qfalse;
 }
 
-void
-byte_buffer_free(void *ptr)
+/*
+ * Returns token of Cassandra's Murmur3Partitioner for len bytes starting at
+ * offset within readable region.
+ */
+VALUE
+rb_byte_buffer_murmur3_token(int argc, VALUE *argv, VALUE self)
 {
-    buffer_t *b = ptr;
-    if (b->b_ptr != b->embedded_buffer) xfree(b->b_ptr);
-    xfree(b);
+    VALUE voffset, vlen;
+    const char *ptr;
+    size_t len;
+    int64_t h1;
+    buffer_t *b;
+
+    rb_scan_args(argc, argv, "02", &voffset, &vlen);
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+    region_from_args(b, voffset, vlen, &ptr, &len);
+
+    h1 = cassandra_murmur3_h1(ptr, len);
+    if (h1 == INT64_MIN)
+        h1 = INT64_MAX;
+
+    return LL2NUM(h1);
 }
 
-size_t
-byte_buffer_memsize(const void *ptr)
+VALUE
+rb_byte_buffer_xxhash64(int argc, VALUE *argv, VALUE self)
 {
-    const buffer_t *b = ptr;
+    VALUE voffset, vlen, vseed;
+    const char *ptr;
+    size_t len;
+    buffer_t *b;
 
-    if (!b) return 0;
+    rb_scan_args(argc, argv, "03", &voffset, &vlen, &vseed);
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+    region_from_args(b, voffset, vlen, &ptr, &len);
 
-    if (b->b_ptr != b->embedded_buffer)
-        return sizeof(buffer_t) + b->size;
-    else
-        return sizeof(buffer_t);
+    return ULL2NUM(xxhash64(ptr, len, NIL_P(vseed) ? 0 : (uint64_t)value_to_int64(vseed)));
+}
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+/*
+ * Returns read-only IO::Buffer sharing memory with readable region. Views are
+ * freed (become invalid) once buffer has to compact or reallocate storage.
+ * Last view is reused while readable region stays the same, others are only
+ * tracked weakly so that views dropped by caller can be collected.
+ */
+VALUE
+rb_byte_buffer_to_io_buffer(VALUE self)
+{
+    buffer_t *b;
+    VALUE view;
+
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+    if (!NIL_P(b->io_buffer)) {
+        void *base;
+        size_t size;
+
+        rb_io_buffer_get_bytes(b->io_buffer, &base, &size);
+        if (base == READ_PTR(b) && size == READ_SIZE(b))
+            return b->io_buffer;
+    }
+
+    view = rb_io_buffer_new(READ_PTR(b), READ_SIZE(b), RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+    rb_ivar_set(view, id_byte_buffer, self);
+
+    if (NIL_P(b->io_buffers))
+        b->io_buffers = rb_class_new_instance(0, NULL, rb_cWeakMap);
+    rb_funcall(b->io_buffers, id_aset, 2, view, view);
+    b->io_buffer = view;
+
+    return view;
+}
+
+VALUE
+rb_byte_buffer_s_from_io_buffer(VALUE klass, VALUE io_buffer)
+{
+    const void *base;
+    size_t len;
+    buffer_t *b;
+    VALUE obj;
+
+    rb_io_buffer_get_bytes_for_reading(io_buffer, &base, &len);
+    obj = rb_class_new_instance(0, NULL, klass);
+    TypedData_Get_Struct(obj, buffer_t, &buffer_data_type, b);
+    ENSURE_WRITE_CAPACITY(b, len);
+    memcpy(WRITE_PTR(b), base, len);
+    b->write_pos += len;
+
+    return obj;
+}
+#endif
+
+#ifdef HAVE_RB_IO_DESCRIPTOR
+/*
+ * Reads up to maxlen bytes from io straight into spare capacity, following
+ * IO#read_nonblock conventions. Returns number of bytes appended. Objects
+ * which are not IO themselves (e.g. SSL sockets) are read through their own
+ * #read_nonblock, never through descriptor they wrap.
+ */
+VALUE
+rb_byte_buffer_read_nonblock(int argc, VALUE *argv, VALUE self)
+{
+    VALUE io, n, opts;
+    rb_io_t *fptr;
+    buffer_t *b;
+    long len;
+    ssize_t r;
+
+    rb_scan_args(argc, argv, "2:", &io, &n, &opts);
+    Check_Type(n, T_FIXNUM);
+    len = FIX2LONG(n);
+    if (len < 0) rb_raise(rb_eRangeError, "Cannot read a negative number of bytes");
+
+    if (!RB_TYPE_P(io, T_FILE))
+        return delegate_read_nonblock(self, io, n, opts);
+
+    GetOpenFile(io, fptr);
+    rb_io_check_readable(fptr);
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+
+    if (len == 0)
+        return INT2FIX(0);
+
+    if (rb_io_read_pending(fptr))
+        return delegate_read_nonblock(self, io, n, opts);
+
+    rb_io_set_nonblock(fptr);
+    ENSURE_WRITE_CAPACITY(b, (size_t)len);
+    do {
+        r = read(rb_io_descriptor(io), WRITE_PTR(b), len);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        int e = errno;
+        if (e == EAGAIN || e == EWOULDBLOCK) {
+            if (exception_disabled_p(opts))
+                return ID2SYM(rb_intern("wait_readable"));
+            rb_readwrite_syserr_fail(RB_IO_WAIT_READABLE, e, "read would block");
+        }
+        rb_syserr_fail(e, "read");
+    }
+    if (r == 0) {
+        if (exception_disabled_p(opts))
+            return Qnil;
+        rb_eof_error();
+    }
+    b->write_pos += r;
+
+    return LONG2NUM(r);
+}
+
+/*
+ * Writes readable region to io following IO#write_nonblock conventions and
+ * consumes bytes that were written. Returns number of bytes written. Objects
+ * which are not IO themselves are written through their own #write_nonblock.
+ */
+VALUE
+rb_byte_buffer_write_nonblock(int argc, VALUE *argv, VALUE self)
+{
+    VALUE io, opts;
+    rb_io_t *fptr;
+    buffer_t *b;
+    ssize_t r;
+
+    rb_scan_args(argc, argv, "1:", &io, &opts);
+
+    if (!RB_TYPE_P(io, T_FILE))
+        return delegate_write_nonblock(self, io, opts);
+
+    io = rb_io_get_write_io(io);
+    GetOpenFile(io, fptr);
+    rb_io_check_writable(fptr);
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+
+    if (READ_SIZE(b) == 0)
+        return INT2FIX(0);
+
+    rb_io_flush(io);
+    rb_io_set_nonblock(fptr);
+    do {
+        r = write(rb_io_descriptor(io), READ_PTR(b), READ_SIZE(b));
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        int e = errno;
+        if (e == EAGAIN || e == EWOULDBLOCK) {
+            if (exception_disabled_p(opts))
+                return ID2SYM(rb_intern("wait_writable"));
+            rb_readwrite_syserr_fail(RB_IO_WAIT_WRITABLE, e, "write would block");
+        }
+        rb_syserr_fail(e, "write");
+    }
+    b->read_pos += r;
+
+    return LONG2NUM(r);
+}
+#endif
+
+VALUE
+rb_bit_io_allocate(VALUE klass)
+{
+    bit_io_t *r;
+    VALUE obj = TypedData_Make_Struct(klass, bit_io_t, &bit_io_data_type, r);
+    r->buffer = Qnil;
+
+    return obj;
+}
+
+VALUE
+rb_bit_io_initialize(VALUE self, VALUE buffer)
+{
+    bit_io_t *r;
+
+    if (!rb_obj_is_kind_of(buffer, rb_cBuffer))
+        rb_raise(rb_eTypeError, "expected ByteBuffer::Buffer, got %s", rb_obj_classname(buffer));
+
+    TypedData_Get_Struct(self, bit_io_t, &bit_io_data_type, r);
+    r->buffer  = buffer;
+    r->bit_pos = 0;
+    r->pending = 0;
+
+    return self;
+}
+
+VALUE
+rb_bit_io_buffer(VALUE self)
+{
+    bit_io_t *r;
+
+    TypedData_Get_Struct(self, bit_io_t, &bit_io_data_type, r);
+
+    return r->buffer;
+}
+
+VALUE
+rb_bit_reader_read_bits(VALUE self, VALUE n)
+{
+    bit_io_t *r;
+    buffer_t *b;
+    size_t len = value_to_bit_count(n, 64);
+    uint64_t v;
+
+    TypedData_Get_Struct(self, bit_io_t, &bit_io_data_type, r);
+    TypedData_Get_Struct(r->buffer, buffer_t, &buffer_data_type, b);
+    bit_reader_ensure(r, b, len);
+    v = peek_bits(READ_PTR(b), READ_SIZE(b), r->bit_pos, len);
+    b->read_pos += (r->bit_pos + len) >> 3;
+    r->bit_pos = (r->bit_pos + len) & 7;
+
+    return ULL2NUM(v);
+}
+
+VALUE
+rb_bit_reader_read_bitmap(VALUE self, VALUE n)
+{
+    bit_io_t *r;
+    buffer_t *b;
+    size_t len = value_to_bit_count(n, (size_t)LONG_MAX);
+    size_t i, j;
+    VALUE ary;
+
+    TypedData_Get_Struct(self, bit_io_t, &bit_io_data_type, r);
+    TypedData_Get_Struct(r->buffer, buffer_t, &buffer_data_type, b);
+    bit_reader_ensure(r, b, len);
+
+    ary = rb_ary_new2(len);
+    for (i = 0; i < len; i += 64) {
+        size_t k = len - i < 64 ? len - i : 64;
+        size_t pos = r->bit_pos + i;
+        uint64_t w = peek_bits(READ_PTR(b) + (pos >> 3), READ_SIZE(b) - (pos >> 3), pos & 7, k);
+
+        for (j = k; j > 0; --j)
+            rb_ary_push(ary, (w >> (j - 1)) & 1 ? Qtrue : Qfalse);
+    }
+    b->read_pos += (r->bit_pos + len) >> 3;
+    r->bit_pos = (r->bit_pos + len) & 7;
+
+    return ary;
+}
+
+VALUE
+rb_bit_reader_read_packed_bitmap(VALUE self, VALUE n)
+{
+    bit_io_t *r;
+    buffer_t *b;
+    size_t len = value_to_bit_count(n, (size_t)LONG_MAX);
+    size_t i;
+    char *str_ptr;
+    VALUE str;
+
+    TypedData_Get_Struct(self, bit_io_t, &bit_io_data_type, r);
+    TypedData_Get_Struct(r->buffer, buffer_t, &buffer_data_type, b);
+    bit_reader_ensure(r, b, len);
+
+    str = rb_str_new(NULL, (len + 7) >> 3);
+    str_ptr = RSTRING_PTR(str);
+    for (i = 0; i < len; i += 64) {
+        size_t k = len - i < 64 ? len - i : 64;
+        size_t pos = r->bit_pos + i;
+        uint64_t w = peek_bits(READ_PTR(b) + (pos >> 3), READ_SIZE(b) - (pos >> 3), pos & 7, k);
+
+        w = htobe64(w << (64 - k));
+        memcpy(str_ptr + (i >> 3), &w, (k + 7) >> 3);
+    }
+    b->read_pos += (r->bit_pos + len) >> 3;
+    r->bit_pos = (r->bit_pos + len) & 7;
+
+    return str;
+}
+
+VALUE
+rb_bit_reader_popcount(VALUE self, VALUE n)
+{
+    bit_io_t *r;
+    buffer_t *b;
+    size_t len = value_to_bit_count(n, (size_t)LONG_MAX);
+    size_t i, count = 0;
+
+    TypedData_Get_Struct(self, bit_io_t, &bit_io_data_type, r);
+    TypedData_Get_Struct(r->buffer, buffer_t, &buffer_data_type, b);
+    bit_reader_ensure(r, b, len);
+
+    for (i = 0; i < len; i += 64) {
+        size_t k = len - i < 64 ? len - i : 64;
+        size_t pos = r->bit_pos + i;
+
+        count += popcount64(peek_bits(READ_PTR(b) + (pos >> 3), READ_SIZE(b) - (pos >> 3), pos & 7, k));
+    }
+
+    return ULONG2NUM(count);
+}
+
+VALUE
+rb_bit_reader_align(VALUE self)
+{
+    bit_io_t *r;
+    buffer_t *b;
+
+    TypedData_Get_Struct(self, bit_io_t, &bit_io_data_type, r);
+    TypedData_Get_Struct(r->buffer, buffer_t, &buffer_data_type, b);
+    if (r->bit_pos > 0 && READ_SIZE(b) > 0)
+        b->read_pos += 1;
+    r->bit_pos = 0;
+
+    return self;
+}
+
+VALUE
+rb_bit_writer_write_bits(VALUE self, VALUE v, VALUE n)
+{
+    bit_io_t *w;
+    buffer_t *b;
+    size_t len = value_to_bit_count(n, 64);
+    uint64_t u64 = (uint64_t)value_to_int64(v);
+
+    if ((len < 64 && (u64 >> len)) || (FIXNUM_P(v) && FIX2LONG(v) < 0) ||
+        (TYPE(v) == T_BIGNUM && !RBIGNUM_SIGN(v)))
+        rb_raise(rb_eRangeError, "Number doesn't fit into %zu bits", len);
+
+    TypedData_Get_Struct(self, bit_io_t, &bit_io_data_type, w);
+    TypedData_Get_Struct(w->buffer, buffer_t, &buffer_data_type, b);
+    bit_writer_write(w, b, u64, len);
+
+    return self;
+}
+
+VALUE
+rb_bit_writer_write_bitmap(VALUE self, VALUE maybe_ary)
+{
+    VALUE ary = rb_check_array_type(maybe_ary);
+    bit_io_t *w;
+    buffer_t *b;
+    long len, i;
+
+    if (NIL_P(ary))
+        rb_raise(rb_eTypeError, "expected Array, got %s", rb_obj_classname(maybe_ary));
+
+    TypedData_Get_Struct(self, bit_io_t, &bit_io_data_type, w);
+    TypedData_Get_Struct(w->buffer, buffer_t, &buffer_data_type, b);
+
+    len = RARRAY_LEN(ary);
+    for (i = 0; i < len; i += 64) {
+        long k = len - i < 64 ? len - i : 64;
+        uint64_t word = 0;
+        long j;
+
+        for (j = 0; j < k; ++j)
+            word = (word << 1) | (RTEST(RARRAY_PTR(ary)[i + j]) ? 1 : 0);
+        bit_writer_write(w, b, word, k);
+    }
+
+    return self;
+}
+
+VALUE
+rb_bit_writer_flush(VALUE self)
+{
+    bit_io_t *w;
+    buffer_t *b;
+
+    TypedData_Get_Struct(self, bit_io_t, &bit_io_data_type, w);
+    TypedData_Get_Struct(w->buffer, buffer_t, &buffer_data_type, b);
+    if (w->bit_pos > 0) {
+        ENSURE_WRITE_CAPACITY(b, 1);
+        *((uint8_t*)WRITE_PTR(b)) = (uint8_t)(w->pending << (8 - w->bit_pos));
+        b->write_pos += 1;
+        w->pending = 0;
+        w->bit_pos = 0;
+    }
+
+    return self;
+}
+
+int32_t
+value_to_int32(VALUE x)
+{
+    if (FIXNUM_P(x)) {
+        int64_t i64 = FIX2LONG(x);
+
+        if (i64 > 0xFFFFFFFF || -i64 > 0x80000000)
+            rb_raise(rb_eRangeError, "Number %" PRId64 " is too big", i64);
+
+        return (int32_t)i64;
+    } else if (TYPE(x) == T_BIGNUM)
+        rb_raise(rb_eRangeError, "expected `interger', got `bignum'");
+    else
+        rb_raise(rb_eTypeError, "expected `interger', got %s ", rb_obj_classname(x));
+
+    return 0;
+}
+
+int64_t
+value_to_int64(VALUE x)
+{
+    if (FIXNUM_P(x))
+        return FIX2LONG(x);
+    else if (TYPE(x) == T_BIGNUM && RBIGNUM_SIGN(x))
+        return (int64_t)rb_big2ull(x);
+    else if (TYPE(x) == T_BIGNUM && !RBIGNUM_SIGN(x))
+        return rb_big2ll(x);
+    else
+        rb_raise(rb_eTypeError, "expected `interger' or `bignum', got %s ", rb_obj_classname(x));
+
+    return 0;
+}
+
+double
+value_to_dbl(VALUE x)
+{
+    if (FIXNUM_P(x))
+        return ((double)FIX2LONG(x));
+    else if (TYPE(x) == T_FLOAT)
+        return RFLOAT_VALUE(x);
+    else if (TYPE(x) == T_BIGNUM)
+        return rb_big2dbl(x);
+    else
+        rb_raise(rb_eTypeError, "expected a numeric type, got %s ", rb_obj_classname(x));
+
+    return 0.0;
+}
+
+/*
+ * Returns frozen string with given contents, reusing the same object for
+ * repeated contents up to BYTE_BUFFER_INTERN_MAX_LEN bytes. Uses VM's fstring
+ * table when available, otherwise falls back to bounded direct mapped cache.
+ */
+VALUE
+interned_str(const char *ptr, long len, rb_encoding *enc)
+{
+#ifndef HAVE_RB_ENC_INTERNED_STR
+    uint32_t h = 2166136261u;
+    long i, slot;
+    VALUE str;
+#endif
+
+    if (len > BYTE_BUFFER_INTERN_MAX_LEN)
+        return rb_str_freeze(rb_enc_str_new(ptr, len, enc));
+
+#ifdef HAVE_RB_ENC_INTERNED_STR
+    return rb_enc_interned_str(ptr, len, enc);
+#else
+    for (i = 0; i < len; ++i)
+        h = (h ^ (uint8_t)ptr[i]) * 16777619u;
+    h ^= (uint32_t)rb_enc_to_index(enc);
+    slot = h & (BYTE_BUFFER_INTERN_CACHE_SIZE - 1);
+
+    str = RARRAY_PTR(intern_cache)[slot];
+    if (!NIL_P(str) && RSTRING_LEN(str) == len && rb_enc_get(str) == enc &&
+        memcmp(RSTRING_PTR(str), ptr, len) == 0)
+        return str;
+
+    str = rb_str_freeze(rb_enc_str_new(ptr, len, enc));
+    rb_ary_store(intern_cache, slot, str);
+
+    return str;
+#endif
+}
+
+size_t
+value_to_bit_count(VALUE n, size_t max)
+{
+    long len;
+
+    Check_Type(n, T_FIXNUM);
+    len = FIX2LONG(n);
+    if (len < 0) rb_raise(rb_eRangeError, "Number of bits can't be negative");
+    if ((size_t)len > max) rb_raise(rb_eRangeError, "Number of bits can't exceed %zu", max);
+
+    return (size_t)len;
+}
+
+/*
+ * Returns n (0..64) bits starting at bit_pos (0..7) of ptr, MSB first,
+ * loading whole 64-bit word when at least 8 bytes are available.
+ */
+uint64_t
+peek_bits(const char *ptr, size_t avail, size_t bit_pos, size_t n)
+{
+    const uint8_t *p = (const uint8_t*)ptr;
+    uint64_t w = 0;
+    size_t i;
+
+    if (n == 0)
+        return 0;
+
+    if (avail >= 8)
+        w = be64toh(*((uint64_t*)p));
+    else
+        for (i = 0; i < avail; ++i)
+            w |= (uint64_t)p[i] << (56 - 8 * i);
+
+    w <<= bit_pos;
+    if (bit_pos + n > 64)
+        w |= p[8] >> (8 - bit_pos);
+
+    return w >> (64 - n);
+}
+
+int
+popcount64(uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+void
+bit_reader_ensure(bit_io_t *r, buffer_t *b, size_t n)
+{
+    size_t avail = READ_SIZE(b) * 8 > r->bit_pos ? READ_SIZE(b) * 8 - r->bit_pos : 0;
+
+    if (n > avail)
+        rb_raise(rb_eRangeError, "%zu bits requred, but only %zu available", n, avail);
+}
+
+void
+bit_writer_write(bit_io_t *w, buffer_t *b, uint64_t v, size_t n)
+{
+    uint8_t out[9];
+    size_t fill, count = 0;
+
+    if (w->bit_pos + n < 8) {
+        w->pending = (uint8_t)((w->pending << n) | v);
+        w->bit_pos += n;
+        return;
+    }
+
+    fill = 8 - w->bit_pos;
+    n -= fill;
+    out[count++] = (uint8_t)((w->pending << fill) | (v >> n));
+    while (n >= 8) {
+        n -= 8;
+        out[count++] = (uint8_t)(v >> n);
+    }
+    w->pending = (uint8_t)(v & ((1u << n) - 1));
+    w->bit_pos = n;
+
+    ENSURE_WRITE_CAPACITY(b, count);
+    memcpy(WRITE_PTR(b), out, count);
+    b->write_pos += count;
+}
+
+/*
+ * Resolves readable bytes of Buffer or String (or object convertible via
+ * to_str, in which case *other is replaced with the conversion result).
+ */
+int
+bytes_of(VALUE *other, const char **ptr, size_t *len)
+{
+    if (rb_obj_is_kind_of(*other, rb_cBuffer)) {
+        buffer_t *other_b;
+        TypedData_Get_Struct(*other, buffer_t, &buffer_data_type, other_b);
+        *ptr = READ_PTR(other_b);
+        *len = READ_SIZE(other_b);
+        return 1;
+    }
+
+    *other = rb_check_string_type(*other);
+    if (NIL_P(*other))
+        return 0;
+    *ptr = RSTRING_PTR(*other);
+    *len = RSTRING_LEN(*other);
+
+    return 1;
+}
+
+void
+region_from_args(buffer_t *b, VALUE voffset, VALUE vlen, const char **ptr, size_t *len)
+{
+    size_t offset = 0;
+
+    if (!NIL_P(voffset)) {
+        long l = NUM2LONG(voffset);
+        if (l < 0) rb_raise(rb_eRangeError, "offset can't be negative");
+        offset = l;
+    }
+    if (offset > READ_SIZE(b))
+        rb_raise(rb_eRangeError, "offset %zu is beyond %zu available bytes", offset, READ_SIZE(b));
+
+    if (!NIL_P(vlen)) {
+        long l = NUM2LONG(vlen);
+        if (l < 0) rb_raise(rb_eRangeError, "length can't be negative");
+        ENSURE_READ_CAPACITY(b, offset + (size_t)l);
+        *len = l;
+    } else
+        *len = READ_SIZE(b) - offset;
+
+    *ptr = READ_PTR(b) + offset;
+}
+
+uint64_t
+load64le(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return le64toh(v);
+}
+
+uint64_t
+murmur3_fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/*
+ * MurmurHash3 x64_128 as implemented by Cassandra, returning first half of
+ * the hash. Unlike reference implementation, Cassandra sign-extends tail
+ * bytes, which changes result for keys with bytes >= 0x80 in the tail.
+ */
+int64_t
+cassandra_murmur3_h1(const char *ptr, size_t len)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const int8_t *tail = (const int8_t*)(ptr + (len & ~(size_t)15));
+    uint64_t h1 = 0, h2 = 0, k1 = 0, k2 = 0;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        k1 = load64le(ptr + i);
+        k2 = load64le(ptr + i + 8);
+
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    k1 = k2 = 0;
+    switch (len & 15) {
+    case 15: k2 ^= (uint64_t)(int64_t)tail[14] << 48; /* fall through */
+    case 14: k2 ^= (uint64_t)(int64_t)tail[13] << 40; /* fall through */
+    case 13: k2 ^= (uint64_t)(int64_t)tail[12] << 32; /* fall through */
+    case 12: k2 ^= (uint64_t)(int64_t)tail[11] << 24; /* fall through */
+    case 11: k2 ^= (uint64_t)(int64_t)tail[10] << 16; /* fall through */
+    case 10: k2 ^= (uint64_t)(int64_t)tail[9] << 8; /* fall through */
+    case 9:  k2 ^= (uint64_t)(int64_t)tail[8];
+             k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2; /* fall through */
+    case 8:  k1 ^= (uint64_t)(int64_t)tail[7] << 56; /* fall through */
+    case 7:  k1 ^= (uint64_t)(int64_t)tail[6] << 48; /* fall through */
+    case 6:  k1 ^= (uint64_t)(int64_t)tail[5] << 40; /* fall through */
+    case 5:  k1 ^= (uint64_t)(int64_t)tail[4] << 32; /* fall through */
+    case 4:  k1 ^= (uint64_t)(int64_t)tail[3] << 24; /* fall through */
+    case 3:  k1 ^= (uint64_t)(int64_t)tail[2] << 16; /* fall through */
+    case 2:  k1 ^= (uint64_t)(int64_t)tail[1] << 8; /* fall through */
+    case 1:  k1 ^= (uint64_t)(int64_t)tail[0];
+             k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = murmur3_fmix64(h1);
+    h2 = murmur3_fmix64(h2);
+    h1 += h2;
+
+    return (int64_t)h1;
+}
+
+uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = ROTL64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+uint64_t
+xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t
+xxhash64(const char *ptr, size_t len, uint64_t seed)
+{
+    const char *end = ptr + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        const char *limit = end - 32;
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+
+        do {
+            v1 = xxh64_round(v1, load64le(ptr));
+            v2 = xxh64_round(v2, load64le(ptr + 8));
+            v3 = xxh64_round(v3, load64le(ptr + 16));
+            v4 = xxh64_round(v4, load64le(ptr + 24));
+            ptr += 32;
+        } while (ptr <= limit);
+
+        h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        h = xxh64_merge_round(h, v1);
+        h = xxh64_merge_round(h, v2);
+        h = xxh64_merge_round(h, v3);
+        h = xxh64_merge_round(h, v4);
+    } else
+        h = seed + XXH_PRIME64_5;
+
+    h += len;
+
+    for (; ptr + 8 <= end; ptr += 8) {
+        h ^= xxh64_round(0, load64le(ptr));
+        h = ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (ptr + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, ptr, 4);
+        h ^= (uint64_t)le32toh(v) * XXH_PRIME64_1;
+        h = ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        ptr += 4;
+    }
+    for (; ptr < end; ++ptr) {
+        h ^= (uint8_t)*ptr * XXH_PRIME64_5;
+        h = ROTL64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+void
+invalidate_io_buffers(buffer_t *buffer_ptr)
+{
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_READING
+    if (!NIL_P(buffer_ptr->io_buffers)) {
+        VALUE views = rb_funcall(buffer_ptr->io_buffers, id_values, 0);
+        long i;
+
+        for (i = 0; i < RARRAY_LEN(views); ++i)
+            if (RTEST(rb_funcall(RARRAY_PTR(views)[i], id_locked_p, 0)))
+                rb_raise(rb_eIOBufferLockedError, "Buffer storage can't be moved while IO::Buffer view is locked!");
+
+        for (i = 0; i < RARRAY_LEN(views); ++i)
+            rb_io_buffer_free(RARRAY_PTR(views)[i]);
+        buffer_ptr->io_buffer = Qnil;
+        buffer_ptr->io_buffers = Qnil;
+    }
+#endif
+}
+
+#ifdef HAVE_RB_IO_DESCRIPTOR
+int
+exception_disabled_p(VALUE opts)
+{
+    VALUE exception = Qundef;
+
+    if (NIL_P(opts))
+        return 0;
+    rb_get_kwargs(opts, &id_exception, 0, 1, &exception);
+
+    return exception == Qfalse;
+}
+
+VALUE
+delegate_read_nonblock(VALUE self, VALUE io, VALUE n, VALUE opts)
+{
+    VALUE args[2];
+    VALUE str;
+
+    args[0] = n;
+    args[1] = opts;
+    if (NIL_P(opts))
+        str = rb_funcallv(io, id_read_nonblock, 1, args);
+    else
+        str = rb_funcallv_kw(io, id_read_nonblock, 2, args, RB_PASS_KEYWORDS);
+
+    if (!RB_TYPE_P(str, T_STRING))
+        return str;
+    rb_byte_buffer_append(self, str);
+
+    return LONG2NUM(RSTRING_LEN(str));
+}
+
+VALUE
+delegate_write_nonblock(VALUE self, VALUE io, VALUE opts)
+{
+    VALUE args[2];
+    VALUE written;
+    buffer_t *b;
+    long len;
+
+    TypedData_Get_Struct(self, buffer_t, &buffer_data_type, b);
+    if (READ_SIZE(b) == 0)
+        return INT2FIX(0);
+
+    args[0] = rb_str_new(READ_PTR(b), READ_SIZE(b));
+    args[1] = opts;
+    if (NIL_P(opts))
+        written = rb_funcallv(io, id_write_nonblock, 1, args);
+    else
+        written = rb_funcallv_kw(io, id_write_nonblock, 2, args, RB_PASS_KEYWORDS);
+
+    if (!RB_INTEGER_TYPE_P(written))
+        return written;
+    len = NUM2LONG(written);
+    if (len < 0 || (size_t)len > READ_SIZE(b))
+        rb_raise(rb_eRangeError, "write_nonblock reported %ld bytes written, but only %zu were given", len, READ_SIZE(b));
+    b->read_pos += len;
+
+    return written;
+}
+#endif
+
+void
+grow_buffer(buffer_t* buffer_ptr, size_t len)
+{
+    size_t new_size = buffer_ptr->write_pos - buffer_ptr->read_pos + len;
+
+    invalidate_io_buffers(buffer_ptr);
+
+    if (new_size <= buffer_ptr->size) {
+        memmove(buffer_ptr->b_ptr, READ_PTR(buffer_ptr), READ_SIZE(buffer_ptr));
+        buffer_ptr->write_pos -= buffer_ptr->read_pos;
+        buffer_ptr->read_pos = 0;
+    } else {
+        char *new_b_ptr;
+
+        new_size += new_size / 2;
+        new_b_ptr = ALLOC_N(char, new_size);
+        memcpy(new_b_ptr, READ_PTR(buffer_ptr), READ_SIZE(buffer_ptr));
+        if (buffer_ptr->b_ptr != buffer_ptr->embedded_buffer) xfree(buffer_ptr->b_ptr);
+        buffer_ptr->b_ptr = new_b_ptr;
+        buffer_ptr->size = new_size;
+        buffer_ptr->write_pos -= buffer_ptr->read_pos;
+        buffer_ptr->read_pos = 0;
+    }
+}
+
+void
+byte_buffer_mark(void *ptr)
+{
+    buffer_t *b = ptr;
+    rb_gc_mark(b->io_buffer);
+    rb_gc_mark(b->io_buffers);
+}
+
+void
+byte_buffer_free(void *ptr)
+{
+    buffer_t *b = ptr;
+    if (b->b_ptr != b->embedded_buffer) xfree(b->b_ptr);
+    xfree(b);
+}
+
+size_t
+byte_buffer_memsize(const void *ptr)
+{
+    const buffer_t *b = ptr;
+
+    if (!b) return 0;
+
+    if (b->b_ptr != b->embedded_buffer)
+        return sizeof(buffer_t) + b->size;
+    else
+        return sizeof(buffer_t);
+}
+
+void
+bit_io_mark(void *ptr)
+{
+    bit_io_t *r = ptr;
+    rb_gc_mark(r->buffer);
+}
+
+void
+bit_io_free(void *ptr)
+{
+    xfree(ptr);
+}
+
+size_t
+bit_io_memsize(const void *ptr)
+{
+    return ptr ? sizeof(bit_io_t) : 0;
 }
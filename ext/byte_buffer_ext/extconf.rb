@@ -1,2 +1,5 @@
 require 'mkmf'
+have_func("rb_enc_interned_str", "ruby/encoding.h")
+have_func("rb_io_descriptor", "ruby/io.h")
+have_func("rb_io_buffer_get_bytes_for_reading", "ruby/io/buffer.h")
 create_makefile("byte_buffer_ext")
@@ -10,17 +10,43 @@ module ByteBuffer
       self.length == 0
     end
 
-    def eql?(other)
-      self.to_str.eql?(other.to_str)
+    def dup
+      self.class.new(self.to_str)
     end
-    alias_method :==, :eql?
 
-    def hash
-      to_str.hash
-    end
+    if method_defined?(:read_nonblock)
+      require 'io/wait'
 
-    def dup
-      self.class.new(self.to_str)
+      # Waits through IO#wait_readable, which defers to Fiber.scheduler when set.
+      def read_from(io, maxlen)
+        loop do
+          n = read_nonblock(io, maxlen, exception: false)
+          return n unless n == :wait_readable || n == :wait_writable
+          wait_for(io, n)
+        end
+      end
+
+      # Writes whole buffer, waiting through IO#wait_writable between writes.
+      def write_to(io)
+        written = 0
+        until empty?
+          n = write_nonblock(io, exception: false)
+          if n == :wait_readable || n == :wait_writable
+            wait_for(io, n)
+          else
+            written += n
+          end
+        end
+        written
+      end
+
+      private
+
+      # IO wrappers such as SSL sockets may only provide #to_io for waiting.
+      def wait_for(io, event)
+        io = io.to_io unless io.respond_to?(event)
+        io.public_send(event)
+      end
     end
   end
 end
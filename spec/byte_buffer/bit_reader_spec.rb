@@ -0,0 +1,67 @@
+# encoding: utf-8
+require 'spec_helper'
+
+describe ByteBuffer::BitReader do
+  let(:buffer) {ByteBuffer::Buffer.new("\xA5\x0F\xFF\x00\x81\x42\x24\x18\xC3\x3C")}
+  let(:reader) {described_class.new(buffer)}
+
+  describe '#read_bits' do
+    it 'reads bits most significant first' do
+      reader.read_bits(3).should == 0b101
+      reader.read_bits(7).should == 0b0010100
+    end
+
+    it 'reads bits spanning 9 bytes' do
+      reader.read_bits(4)
+      reader.read_bits(64).should == 0x50FFF0081422418C
+    end
+
+    it 'consumes whole bytes only' do
+      reader.read_bits(12)
+      buffer.length.should == 9
+    end
+
+    it 'raises an error when there are not enough bits in the buffer' do
+      reader.read_bits(60)
+      expect { reader.read_bits(21) }.to raise_error(RangeError)
+    end
+
+    it 'raises an error when asked for more than 64 bits' do
+      expect { reader.read_bits(65) }.to raise_error(RangeError)
+    end
+  end
+
+  describe '#read_bitmap' do
+    it 'decodes bits into booleans' do
+      reader.read_bits(4)
+      reader.read_bitmap(6).should == [false, true, false, true, false, false]
+    end
+  end
+
+  describe '#read_packed_bitmap' do
+    it 'returns bits realigned to the first byte' do
+      reader.read_bits(4)
+      reader.read_packed_bitmap(12).should eql_bytes("\x50\xF0")
+    end
+  end
+
+  describe '#popcount' do
+    it 'counts set bits without consuming them' do
+      reader.read_bits(1)
+      reader.popcount(79).should == 31
+      buffer.length.should == 10
+    end
+  end
+
+  describe '#align' do
+    it 'skips the rest of the current byte' do
+      reader.read_bits(1)
+      reader.align
+      reader.read_bits(8).should == 0x0F
+    end
+  end
+
+  it 'raises type error when not given a buffer' do
+    expect { described_class.new("\xA5") }.to raise_error(TypeError)
+  end
+end
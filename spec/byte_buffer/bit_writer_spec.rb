@@ -0,0 +1,64 @@
+# encoding: utf-8
+require 'spec_helper'
+
+describe ByteBuffer::BitWriter do
+  let(:buffer) {ByteBuffer::Buffer.new}
+  let(:writer) {described_class.new(buffer)}
+
+  describe '#write_bits' do
+    it 'writes bits most significant first' do
+      writer.write_bits(0b101, 3)
+      writer.write_bits(0b00101, 5)
+      buffer.should eql_bytes("\xA5")
+    end
+
+    it 'keeps incomplete byte until flushed' do
+      writer.write_bits(0xA5, 8)
+      writer.write_bits(0b1, 1)
+      buffer.should eql_bytes("\xA5")
+      writer.flush
+      buffer.should eql_bytes("\xA5\x80")
+    end
+
+    it 'writes 64 bits across byte boundary' do
+      writer.write_bits(0, 4)
+      writer.write_bits(0xFFFFFFFFFFFFFFFF, 64)
+      writer.flush
+      buffer.should eql_bytes("\x0F\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xF0")
+    end
+
+    it "raises error when number doesn't fit into given number of bits" do
+      expect { writer.write_bits(4, 2) }.to raise_error(RangeError)
+      expect { writer.write_bits(-1, 2) }.to raise_error(RangeError)
+    end
+
+    it 'raises error when given negative number of bits' do
+      expect { writer.write_bits(1, -1) }.to raise_error(RangeError, /negative/)
+    end
+
+    it 'returns the writer' do
+      writer.write_bits(1, 1).should equal(writer)
+    end
+  end
+
+  describe '#write_bitmap' do
+    it 'encodes booleans as bits' do
+      writer.write_bitmap([true, false, true, false, false, true, false, true, true])
+      writer.flush
+      buffer.should eql_bytes("\xA5\x80")
+    end
+
+    it 'raises type error' do
+      expect { writer.write_bitmap('lol') }.to raise_error(TypeError)
+    end
+  end
+
+  it 'round trips through BitReader' do
+    writer.write_bits(3, 2)
+    writer.write_bits(0x123456789, 40)
+    writer.flush
+    reader = ByteBuffer::BitReader.new(buffer)
+    reader.read_bits(2).should == 3
+    reader.read_bits(40).should == 0x123456789
+  end
+end
@@ -130,6 +130,177 @@ describe ByteBuffer::Buffer, "extended interface" do
     end
   end
 
+  describe '#read_interned' do
+    it 'returns the first n bytes as frozen string' do
+      buffer = described_class.new("abcdef")
+      str = buffer.read_interned(3)
+      str.should == 'abc'
+      str.should be_frozen
+    end
+
+    it 'returns the same object for repeated contents' do
+      buffer = described_class.new("abcabc")
+      buffer.read_interned(3).should equal(buffer.read_interned(3))
+    end
+
+    it "doesn't intern long strings" do
+      buffer = described_class.new('x' * 200)
+      str = buffer.read_interned(100)
+      str.should be_frozen
+      str.should_not equal(buffer.read_interned(100))
+    end
+
+    it 'consumes the bytes' do
+      buffer = described_class.new("abcdef")
+      buffer.read_interned(4)
+      buffer.should eql_bytes('ef')
+    end
+
+    it 'raises an error when there is not enough bytes available' do
+      buffer = described_class.new("abc")
+      expect { buffer.read_interned(4) }.to raise_error(RangeError)
+    end
+
+    it 'raises an error when given negative length' do
+      expect { buffer.read_interned(-1) }.to raise_error(RangeError)
+    end
+  end
+
+  describe '#read_cql_string_interned' do
+    it 'decodes a short string as frozen utf-8 string' do
+      buffer = described_class.new("\x00\x03foobar")
+      str = buffer.read_cql_string_interned
+      str.should == 'foo'
+      str.encoding.should == Encoding::UTF_8
+      str.should be_frozen
+    end
+
+    it 'returns the same object for repeated contents' do
+      buffer = described_class.new("\x00\x03foo\x00\x03foo")
+      buffer.read_cql_string_interned.should equal(buffer.read_cql_string_interned)
+    end
+
+    it 'consumes the bytes' do
+      buffer = described_class.new("\x00\x03foobar")
+      buffer.read_cql_string_interned
+      buffer.should eql_bytes('bar')
+    end
+
+    it "doesn't consume bytes when there is not enough bytes available" do
+      buffer = described_class.new("\x00\x05foo")
+      expect { buffer.read_cql_string_interned }.to raise_error(RangeError)
+      buffer.should eql_bytes("\x00\x05foo")
+    end
+  end
+
+  describe '#has?' do
+    it 'tells whether given number of bytes is available' do
+      buffer = described_class.new("\x01\x02\x03")
+      buffer.has?(3).should == true
+      buffer.has?(4).should == false
+    end
+
+    it 'raises error when given negative length' do
+      expect { buffer.has?(-1) }.to raise_error(RangeError)
+    end
+  end
+
+  describe 'try_read methods' do
+    it 'decode values like their raising counterparts' do
+      buffer = described_class.new("\xff\xee\xdd\xcc\x00\x03foo\x81\x02xyz")
+      buffer.try_read_int(true).should == -1122868
+      buffer.try_read_cql_string_interned.should == 'foo'
+      buffer.try_read_byte_array(2, true).should == [-127, 2]
+      buffer.try_read(3).should == 'xyz'
+    end
+
+    it 'return nil without consuming when there is not enough bytes available' do
+      buffer = described_class.new("\x00\x05a")
+      [
+        buffer.try_read(6), buffer.try_read_long, buffer.try_read_int,
+        buffer.try_read_double, buffer.try_read_float, buffer.try_read_byte_array(6),
+        buffer.try_read_interned(6), buffer.try_read_cql_string_interned
+      ].should == [nil] * 8
+      buffer.should eql_bytes("\x00\x05a")
+    end
+
+    it 'return nil for an empty buffer' do
+      buffer.try_read_short.should be_nil
+      buffer.try_read_byte.should be_nil
+    end
+
+    it 'raise error when given negative length' do
+      expect { buffer.try_read(-1) }.to raise_error(RangeError)
+    end
+  end
+
+  describe '#eql?' do
+    it 'compares readable bytes only' do
+      b1 = described_class.new('xfoo')
+      b1.read(1)
+      b1.should eql(described_class.new('foo'))
+    end
+
+    it 'is equal to a string with the same contents' do
+      described_class.new('foo').should eql('foo')
+    end
+
+    it 'is not equal to a non-ASCII UTF-8 string with the same bytes' do
+      str = [0xe9].pack('U')
+      buffer = described_class.new(str)
+      buffer.should_not eql(str)
+      buffer.should eql(str.b)
+    end
+
+    it 'is not equal to objects which are not strings' do
+      described_class.new('1').should_not == 1
+    end
+  end
+
+  describe '#hash' do
+    it 'is equal to the hash code of its contents' do
+      b1 = described_class.new('xfoo')
+      b1.read(1)
+      b1.hash.should == 'foo'.hash
+    end
+  end
+
+  describe '#<=>' do
+    it 'compares contents bytewise' do
+      buffer = described_class.new('foo')
+      (buffer <=> described_class.new('fop')).should == -1
+      (buffer <=> 'fo').should == 1
+      (buffer <=> 'foo').should == 0
+    end
+
+    it 'returns nil for objects which are not strings' do
+      (described_class.new('foo') <=> 1).should be_nil
+    end
+  end
+
+  describe '#start_with?' do
+    it 'checks prefixes of readable bytes' do
+      buffer = described_class.new('xfoobar')
+      buffer.read(1)
+      buffer.start_with?('bar', 'foo').should == true
+      buffer.start_with?('x').should == false
+      buffer.start_with?('foobarbaz').should == false
+    end
+
+    it 'raises type error' do
+      expect { buffer.start_with?(1) }.to raise_error(TypeError)
+    end
+  end
+
+  describe '#end_with?' do
+    it 'checks suffixes of readable bytes' do
+      buffer = described_class.new('foobar')
+      buffer.end_with?(described_class.new('bar')).should == true
+      buffer.end_with?('foo').should == false
+      buffer.end_with?('xfoobar').should == false
+    end
+  end
+
   describe '#append_long' do
     it 'encodes a long' do
       buffer.append_long(0x0123456789)
@@ -0,0 +1,52 @@
+# encoding: utf-8
+require 'spec_helper'
+
+describe ByteBuffer::Buffer, "hashing" do
+  describe '#murmur3_token' do
+    it 'matches Murmur3Partitioner tokens' do
+      described_class.new('123').murmur3_token.should == -7468325962851647638
+      described_class.new('9223372036854775807').murmur3_token.should == 7162290910810015547
+      described_class.new("\x00\xff\x10\xfa\x99" * 10).murmur3_token.should == 5837342703291459765
+    end
+
+    it 'sign-extends tail bytes like Cassandra does' do
+      described_class.new("\xfe" * 8).murmur3_token.should == -8927430733708461935
+      described_class.new("\x10" * 8).murmur3_token.should == 1446172840243228796
+    end
+
+    it 'hashes region relative to read position' do
+      buffer = described_class.new('xx123yy')
+      buffer.read(1)
+      buffer.murmur3_token(1, 3).should == -7468325962851647638
+    end
+
+    it "doesn't consume the bytes" do
+      buffer = described_class.new('123')
+      buffer.murmur3_token
+      buffer.should eql_bytes('123')
+    end
+
+    it 'raises an error when region exceeds readable bytes' do
+      buffer = described_class.new('123')
+      expect { buffer.murmur3_token(1, 3) }.to raise_error(RangeError)
+    end
+  end
+
+  describe '#xxhash64' do
+    it 'matches reference values' do
+      described_class.new('').xxhash64.should == 0xEF46DB3751D8E999
+      described_class.new('abc').xxhash64.should == 0x44BC2CF5AD770999
+      described_class.new('Nobody inspects the spammish repetition').xxhash64.should == 0xFBCEA83C8A378BF1
+    end
+
+    it 'hashes given region' do
+      buffer = described_class.new('--abc--')
+      buffer.xxhash64(2, 3).should == 0x44BC2CF5AD770999
+    end
+
+    it 'depends on seed' do
+      buffer = described_class.new('abc')
+      buffer.xxhash64(0, 3, 1).should_not == buffer.xxhash64(0, 3, 0)
+    end
+  end
+end
@@ -0,0 +1,195 @@
+# encoding: utf-8
+require 'spec_helper'
+require 'socket'
+
+describe ByteBuffer::Buffer, "IO interop" do
+  # Stands for IO wrappers like OpenSSL::SSL::SSLSocket, which transform data
+  # and expose underlying socket via #to_io.
+  let(:wrapper_class) do
+    Class.new do
+      def initialize(io)
+        @io = io
+      end
+
+      def to_io
+        @io
+      end
+
+      def read_nonblock(maxlen, exception: true)
+        data = @io.read_nonblock(maxlen, exception: exception)
+        data.is_a?(String) ? data.upcase : data
+      end
+
+      def write_nonblock(str, exception: true)
+        @io.write_nonblock(str.upcase, exception: exception)
+      end
+    end
+  end
+
+  describe '#to_io_buffer', if: described_class.method_defined?(:to_io_buffer) do
+    let(:buffer) {described_class.new("hello world")}
+
+    it 'exposes readable region' do
+      buffer.read(6)
+      buffer.to_io_buffer.get_string.should == 'world'
+    end
+
+    it 'shares memory with the buffer' do
+      view = buffer.to_io_buffer
+      buffer.update(0, 'H')
+      view.get_string.should == 'Hello world'
+    end
+
+    it 'is read only' do
+      buffer.to_io_buffer.should be_readonly
+    end
+
+    it 'is invalidated when the buffer reallocates' do
+      view = buffer.to_io_buffer
+      buffer.append('x' * 1000)
+      view.should be_null
+    end
+
+    it 'is invalidated when the buffer is reinitialized with bigger storage' do
+      view = buffer.to_io_buffer
+      buffer.send(:initialize, nil, 100_000)
+      view.should be_null
+    end
+
+    it 'returns the same view while readable region is unchanged' do
+      buffer.to_io_buffer.should equal(buffer.to_io_buffer)
+    end
+
+    it "doesn't keep views which are no longer referenced" do
+      buffer = described_class.new('x' * 1000)
+      1000.times { buffer.read(1); buffer.to_io_buffer }
+      GC.start
+      ObjectSpace.each_object(IO::Buffer).count.should be < 100
+    end
+
+    it 'keeps views valid when one of them is locked' do
+      view = buffer.to_io_buffer
+      buffer.read(1)
+      locked_view = buffer.to_io_buffer
+      locked_view.locked do
+        expect { buffer.append('x' * 1000) }.to raise_error(IO::Buffer::LockedError)
+      end
+      view.should_not be_null
+      locked_view.should_not be_null
+    end
+  end
+
+  describe '.from_io_buffer', if: described_class.respond_to?(:from_io_buffer) do
+    it 'creates buffer with contents of IO::Buffer' do
+      buffer = described_class.from_io_buffer(IO::Buffer.for("abc"))
+      buffer.should eql_bytes('abc')
+    end
+  end
+
+  describe '#read_nonblock', if: described_class.method_defined?(:read_nonblock) do
+    let(:sockets) {UNIXSocket.pair}
+    let(:buffer) {described_class.new('>')}
+
+    after do
+      sockets.each(&:close)
+    end
+
+    it 'appends at most maxlen bytes and returns their number' do
+      sockets[1].write('abcdef')
+      buffer.read_nonblock(sockets[0], 4).should == 4
+      buffer.should eql_bytes('>abcd')
+    end
+
+    it 'raises IO::WaitReadable when no data is available' do
+      expect { buffer.read_nonblock(sockets[0], 4) }.to raise_error(IO::WaitReadable)
+    end
+
+    it 'returns :wait_readable when exceptions are disabled' do
+      buffer.read_nonblock(sockets[0], 4, exception: false).should == :wait_readable
+    end
+
+    it 'raises EOFError at end of file' do
+      sockets[1].close
+      expect { buffer.read_nonblock(sockets[0], 4) }.to raise_error(EOFError)
+    end
+
+    it 'reads through IO wrappers instead of their underlying IO' do
+      sockets[1].write('abc')
+      buffer.read_nonblock(wrapper_class.new(sockets[0]), 4).should == 3
+      buffer.should eql_bytes('>ABC')
+    end
+
+    it 'passes exception option to IO wrappers' do
+      buffer.read_nonblock(wrapper_class.new(sockets[0]), 4, exception: false).should == :wait_readable
+    end
+
+    it 'takes data already buffered by the IO' do
+      sockets[1].write("a\nbc")
+      sockets[0].gets
+      buffer.read_nonblock(sockets[0], 4).should == 2
+      buffer.should eql_bytes('>bc')
+    end
+  end
+
+  describe '#write_nonblock', if: described_class.method_defined?(:write_nonblock) do
+    let(:sockets) {UNIXSocket.pair}
+
+    after do
+      sockets.each(&:close)
+    end
+
+    it 'writes and consumes readable bytes' do
+      buffer = described_class.new('abcdef')
+      buffer.read(2)
+      buffer.write_nonblock(sockets[1]).should == 4
+      buffer.length.should == 0
+      sockets[0].read(4).should == 'cdef'
+    end
+
+    it 'writes through IO wrappers instead of their underlying IO' do
+      buffer = described_class.new('secret')
+      buffer.write_nonblock(wrapper_class.new(sockets[1])).should == 6
+      buffer.length.should == 0
+      sockets[0].read(6).should == 'SECRET'
+    end
+
+    it 'returns :wait_writable when exceptions are disabled' do
+      buffer = described_class.new('x' * 10_000_000)
+      buffer.write_nonblock(sockets[1])
+      buffer.write_nonblock(sockets[1], exception: false).should == :wait_writable
+    end
+  end
+
+  describe '#write_to', if: described_class.method_defined?(:write_to) do
+    it 'writes the whole buffer' do
+      r, w = UNIXSocket.pair
+      reader = Thread.new { n = 0; n += r.readpartial(1 << 20).size while n < 5_000_000; n }
+      buffer = described_class.new('x' * 5_000_000)
+      buffer.write_to(w).should == 5_000_000
+      buffer.length.should == 0
+      reader.value.should == 5_000_000
+      [r, w].each(&:close)
+    end
+
+    it 'writes the whole buffer through IO wrappers' do
+      r, w = UNIXSocket.pair
+      reader = Thread.new { n = 0; n += r.readpartial(1 << 20).size while n < 5_000_000; n }
+      buffer = described_class.new('x' * 5_000_000)
+      buffer.write_to(wrapper_class.new(w)).should == 5_000_000
+      reader.value.should == 5_000_000
+      [r, w].each(&:close)
+    end
+  end
+
+  describe '#read_from', if: described_class.method_defined?(:read_from) do
+    it 'waits until data is available' do
+      r, w = UNIXSocket.pair
+      writer = Thread.new { sleep 0.05; w.write('late') }
+      buffer = described_class.new
+      buffer.read_from(r, 10).should == 4
+      buffer.should eql_bytes('late')
+      writer.join
+      [r, w].each(&:close)
+    end
+  end
+end